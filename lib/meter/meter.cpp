@@ -0,0 +1,152 @@
+#include "meter.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <ArduinoJson.h>
+
+CycleDetector::CycleDetector(float treshold, unsigned long endOfCycle)
+    : treshold(treshold), endOfCycle(endOfCycle), device_state(DEVICE_OFF), start(0), end(0)
+{
+}
+
+CycleEvent CycleDetector::update(float ampsRMS, uint64_t windowStart, uint64_t windowEnd)
+{
+  bool active = ampsRMS >= treshold;
+  // IF the device is OFF and the current is more than the treshold
+  // THEN the cycle has started
+  if (active && device_state == DEVICE_OFF)
+  {
+    device_state = DEVICE_ON;
+    start = windowStart;
+    end = windowEnd;
+    return CYCLE_STARTED;
+  }
+  if (active && device_state == DEVICE_ENDING)
+  {
+    device_state = DEVICE_ON;
+  }
+  if (device_state == DEVICE_ON)
+  {
+    if (active)
+    {
+      end = windowEnd;
+    }
+    else
+    {
+      device_state = DEVICE_ENDING;
+    }
+  }
+  // IF the current was less than the treshold for endOfCycle ms
+  // THEN the cycle has ended
+  if (device_state == DEVICE_ENDING && (windowEnd - end) >= (uint64_t)endOfCycle * 1000)
+  {
+    device_state = DEVICE_OFF;
+    return CYCLE_ENDED;
+  }
+  return CYCLE_NONE;
+}
+
+OperatingTime::OperatingTime(uint64_t operatedMillis, uint64_t lastCycleMillis)
+    : lastCycle(lastCycleMillis), operated(operatedMillis), operatedAtStart(operatedMillis)
+{
+}
+
+bool OperatingTime::update(const CycleDetector &cycle, CycleEvent event)
+{
+  bool changed = false;
+  if (event == CYCLE_STARTED)
+  {
+    // lastCycle still holds the previous cycle, which may be just as long
+    operatedAtStart = operated;
+    changed = lastCycle != 0;
+    lastCycle = 0;
+  }
+  // the time the device was on: from the start of the first
+  // to the end of the last window above the treshold
+  if (cycle.running() || event == CYCLE_ENDED)
+  {
+    uint64_t cycleMillis = cycle.cycleTime() / 1000;
+    if (cycleMillis != lastCycle)
+    {
+      lastCycle = cycleMillis;
+      operated = operatedAtStart + lastCycle;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+float amps_rms(double sum, double samples, float slope, float intercept)
+{
+  if (samples <= 0)
+  {
+    return 0;
+  }
+  float amps = (sqrt(sum / samples) * (6.144 / 32768) * slope) - intercept;
+  if (amps < 0)
+  {
+    amps = 0;
+  }
+  return amps;
+}
+
+static JsonObject add_metadata(JsonObject object, const MeterInfo &info)
+{
+  JsonObject meta = object.createNestedObject("metadata");
+  meta["wasmachine_id"] = info.wasmachine_id;
+  meta["sensor_id"] = info.sensor_id;
+  meta["this_cycle_time"] = info.this_cycle_time;
+  meta["total_time_operated"] = info.total_time_operated;
+  meta["timestamp_us"] = info.timestamp;
+  if (info.unix_ms != 0)
+  {
+    meta["unix_ms"] = info.unix_ms;
+  }
+  return meta;
+}
+
+size_t build_state_payload(char *buffer, size_t size, const char *state, const MeterInfo &info)
+{
+  char group[12];
+  snprintf(group, sizeof(group), "%lu", (unsigned long)info.session_id);
+  StaticJsonDocument<512> JSONbuffer;
+  JsonArray array = JSONbuffer.to<JsonArray>();
+  JsonObject object = array.createNestedObject();
+  object["variable"] = "state";
+  object["value"] = state;
+  object["group"] = group;
+  JsonObject meta = add_metadata(object, info);
+  if (info.cycle_start != 0)
+  {
+    meta["cycle_start_us"] = info.cycle_start;
+  }
+  if (info.cycle_end != 0)
+  {
+    meta["cycle_end_us"] = info.cycle_end;
+    meta["cycle_time_ms"] = (info.cycle_end - info.cycle_start) / 1000;
+  }
+  if (measureJson(JSONbuffer) >= size)
+  {
+    return 0;
+  }
+  return serializeJson(JSONbuffer, buffer, size);
+}
+
+size_t build_current_payload(char *buffer, size_t size, float ampsRMS, const MeterInfo &info)
+{
+  char group[12];
+  snprintf(group, sizeof(group), "%lu", (unsigned long)info.session_id);
+  StaticJsonDocument<512> JSONbuffer;
+  JsonArray array = JSONbuffer.to<JsonArray>();
+  JsonObject object = array.createNestedObject();
+  object["variable"] = "current";
+  object["group"] = group;
+  object["unit"] = "mA";
+  object["value"] = int(ampsRMS * 1000);
+  add_metadata(object, info);
+  if (measureJson(JSONbuffer) >= size)
+  {
+    return 0;
+  }
+  return serializeJson(JSONbuffer, buffer, size);
+}
@@ -0,0 +1,108 @@
+// Meter logic shared by the firmware (src/main.cpp) and the host side
+// fleet simulator (src/fleet_sim). No Arduino dependencies in here,
+// only ArduinoJson, so it builds for the ESP32 and for the native platform.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef END_OF_CYCLE
+#define END_OF_CYCLE 360000 // 3 minutes treshold
+#endif
+#ifndef CYCLE_TRESHOLD
+#define CYCLE_TRESHOLD 0.2
+#endif
+
+// device_state values, as used in the firmware
+enum DeviceState
+{
+  DEVICE_OFF = 0,   // no cycle running
+  DEVICE_ON = 2,    // cycle running
+  DEVICE_ENDING = 3 // current below the treshold, waiting for END_OF_CYCLE
+};
+
+// what happened to the cycle on the last update()
+enum CycleEvent
+{
+  CYCLE_NONE = 0,
+  CYCLE_STARTED,
+  CYCLE_ENDED
+};
+
+// Detects the start and end of a wash cycle from the RMS current.
+// A cycle starts when the current reaches the treshold and ends when
+// it stays below the treshold for endOfCycle milliseconds.
+// The cycle runs from the start of the first window above the treshold
+// to the end of the last one, so its length is exact to one window.
+class CycleDetector
+{
+public:
+  CycleDetector(float treshold = CYCLE_TRESHOLD, unsigned long endOfCycle = END_OF_CYCLE);
+
+  // feed one RMS window. windowStart and windowEnd are the monotonic
+  // timestamps in µs of the first and last sample of the window.
+  CycleEvent update(float ampsRMS, uint64_t windowStart, uint64_t windowEnd);
+
+  int state() const { return device_state; }
+  // true while a cycle is running, including the END_OF_CYCLE wait
+  bool running() const { return device_state == DEVICE_ON || device_state == DEVICE_ENDING; }
+
+  // µs timestamps of the current or last cycle.
+  // cycleEnd() is the end of the last window above the treshold so far.
+  uint64_t cycleStart() const { return start; }
+  uint64_t cycleEnd() const { return end; }
+  uint64_t cycleTime() const { return end - start; }
+
+private:
+  float treshold;
+  unsigned long endOfCycle;
+  int device_state;
+  uint64_t start;
+  uint64_t end;
+};
+
+// Operating time bookkeeping in integer ms. The time of the running cycle is
+// recomputed from the cycle timestamps every window, so no rounding error accumulates.
+class OperatingTime
+{
+public:
+  // start from the values saved before
+  OperatingTime(uint64_t operatedMillis = 0, uint64_t lastCycleMillis = 0);
+
+  // call after every CycleDetector::update() with its result.
+  // Returns true when the times changed and should be saved.
+  bool update(const CycleDetector &cycle, CycleEvent event);
+
+  uint64_t lastCycleMillis() const { return lastCycle; } // duration of the last (or current) cycle
+  uint64_t operatedMillis() const { return operated; }   // total time of operation
+
+private:
+  uint64_t lastCycle;
+  uint64_t operated;
+  uint64_t operatedAtStart; // operated at the start of the current cycle
+};
+
+// metadata sent with every message
+struct MeterInfo
+{
+  int wasmachine_id;
+  int sensor_id;
+  uint32_t session_id;
+  unsigned long this_cycle_time;     // seconds since the start of the cycle
+  unsigned long total_time_operated; // total seconds of operation
+  uint64_t timestamp;                // µs, monotonic, start of the RMS window
+  uint64_t unix_ms;                  // wall clock of timestamp in ms, 0 if not synced
+  uint64_t cycle_start;              // µs, state messages only, 0 = not sent
+  uint64_t cycle_end;                // µs, end message only, 0 = not sent
+};
+
+// convert the averaged squared ADC values of one window to amps RMS.
+// sqrt the mean, multiply by volt per bit and by slope (1/accuracy in V/A).
+// intercept is the zero adjustment. Never returns a negative value.
+float amps_rms(double sum, double samples, float slope, float intercept);
+
+// build the JSON messages. Return the length written to buffer, 0 on overflow.
+// state: "1" = ON, "2" = OFF. Adds the cycle timestamps when they are set.
+size_t build_state_payload(char *buffer, size_t size, const char *state, const MeterInfo &info);
+// current is sent in mA as int
+size_t build_current_payload(char *buffer, size_t size, float ampsRMS, const MeterInfo &info);
@@ -0,0 +1,57 @@
+#include "histogram.h"
+
+#include <math.h>
+#include <algorithm>
+
+#define HISTOGRAM_MIN 0.01    // ms, upper edge of the first bucket
+#define HISTOGRAM_GROWTH 1.05 // every bucket is 5% wider than the one before
+#define HISTOGRAM_BUCKETS 340 // up to about 160 s, the last bucket takes the rest
+
+// upper edge of bucket i
+static double bucket_edge(size_t i)
+{
+  return HISTOGRAM_MIN * pow(HISTOGRAM_GROWTH, i);
+}
+
+Histogram::Histogram() : buckets(HISTOGRAM_BUCKETS), total(0), maxValue(0)
+{
+}
+
+void Histogram::add(double ms)
+{
+  size_t i = 0;
+  if (ms > HISTOGRAM_MIN)
+  {
+    i = std::min<size_t>(ceil(log(ms / HISTOGRAM_MIN) / log(HISTOGRAM_GROWTH)), HISTOGRAM_BUCKETS - 1);
+  }
+  buckets[i]++;
+  total++;
+  maxValue = std::max(maxValue, ms);
+}
+
+void Histogram::clear()
+{
+  std::fill(buckets.begin(), buckets.end(), 0);
+  total = 0;
+  maxValue = 0;
+}
+
+double Histogram::percentile(double p) const
+{
+  if (total == 0)
+  {
+    return 0;
+  }
+  // same rank as the p-th element of the sorted values
+  uint64_t rank = (uint64_t)(p * (total - 1));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); i++)
+  {
+    seen += buckets[i];
+    if (seen > rank)
+    {
+      return std::min(bucket_edge(i), maxValue);
+    }
+  }
+  return maxValue;
+}
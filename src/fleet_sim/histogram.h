@@ -0,0 +1,26 @@
+// Latency histogram for the fleet simulator. The number of buckets is
+// fixed, so long runs use constant memory. The bucket edges grow by 5%,
+// so a percentile is exact to 5%.
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+class Histogram
+{
+public:
+  Histogram();
+
+  void add(double ms);
+  void clear();
+
+  uint64_t count() const { return total; }
+  double max() const { return maxValue; }
+  // upper edge of the bucket that holds the p-th value, p from 0 to 1
+  double percentile(double p) const;
+
+private:
+  std::vector<uint64_t> buckets;
+  uint64_t total;
+  double maxValue;
+};
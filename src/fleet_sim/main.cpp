@@ -0,0 +1,557 @@
+// Fleet simulator: runs hundreds of virtual meters against one MQTT broker
+// to find where the ingest side saturates.
+//
+// Every virtual meter runs the same cycle detection and payload builders as
+// the firmware (lib/meter) on a simulated wash machine, and publishes on its
+// own topics with its own SENSOR_ID/WASMACHINE_ID and session IDs.
+// A monitor client subscribes to all topics to measure the end to end latency.
+//
+// build and run with PlatformIO:
+//   pio run -e fleet_sim
+//   .pio/build/fleet_sim/program --host localhost --meters 200 --speed 60
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <meter.h>
+#include "histogram.h"
+#include "mqtt.h"
+#include "profile.h"
+
+#define WINDOW_MS 1000      // one RMS window, printPeriod in the firmware
+#define RECONNECT_PERIOD 5  // s between reconnect attempts per meter
+#define DRAIN_TIME 2        // s to wait for the last messages after stopping
+#define MAX_CATCH_UP 2      // windows a meter may run late per pass, older ones are dropped
+#define LOST_AFTER 30       // s, a message that did not arrive by then counts as lost
+
+// calibration of the firmware, used to turn the simulated current into ADC sums
+#define SLOPE 11
+#define INTERCEPT 0.07
+#define VOLT_PER_BIT (6.144 / 32768)
+#define SAMPLES_PER_WINDOW 860
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options
+{
+  const char *host = "localhost";
+  uint16_t port = 1883;
+  const char *user = NULL;
+  const char *password = NULL;
+  const char *prefix = "sim";
+  int meters = 100;
+  int firstId = 1000;
+  double speed = 60;   // simulated seconds per real second
+  int duration = 60;   // s, real time
+  int report = 5;      // s between reports
+  int idle = 30;       // max minutes between two cycles, simulated time
+  unsigned seed = 0;
+  bool latency = true;
+};
+
+struct VirtualMeter
+{
+  int id; // used as SENSOR_ID and WASMACHINE_ID
+  char clientId[32];
+  char topic[64];      // PUB_TOPIC
+  char stateTopic[64]; // STATE_TOPIC
+  MqttClient client;
+  std::mt19937 rng;
+
+  WashProfile profile;
+  CycleDetector cycle;
+  bool washing = false;
+  uint64_t simTime = 0;      // ms
+  uint64_t programStart = 0; // ms, start of the current program
+  uint64_t nextProgram = 0;  // ms, start of the next program when idle
+
+  uint32_t session_id = 0;
+  OperatingTime operating;
+
+  Clock::time_point nextStep;
+  Clock::time_point nextConnect;
+};
+
+// counters shared between the publisher loop and the monitor thread
+struct Stats
+{
+  std::atomic<uint64_t> sent{0};
+  std::atomic<uint64_t> sentBytes{0};
+  std::atomic<uint64_t> errors{0};
+  std::atomic<uint64_t> received{0};
+  std::atomic<uint64_t> reconnects{0};
+  std::atomic<uint64_t> dropped{0}; // windows skipped because the simulator fell behind
+  std::mutex lock; // for everything below
+  std::unordered_map<std::string, Clock::time_point> pending; // topic\npayload -> send time
+  uint64_t lost = 0;                                          // expired from pending
+  Histogram latencies;                                        // ms, since the last report
+  Histogram allLatencies;                                     // ms, whole run
+};
+
+static Options options;
+static Stats stats;
+static std::atomic<bool> stopping(false);
+
+static void on_signal(int)
+{
+  stopping = true;
+}
+
+static void print_latency(const Histogram &values)
+{
+  if (values.count() == 0)
+  {
+    printf("latency -");
+    return;
+  }
+  printf("latency p50 %.2f p95 %.2f p99 %.2f max %.2f ms",
+         values.percentile(0.50), values.percentile(0.95), values.percentile(0.99), values.max());
+}
+
+// count the messages that are waiting longer than LOST_AFTER as lost,
+// so pending does not grow for the whole run. Call with stats.lock held.
+static void expire_pending(Clock::time_point now)
+{
+  Clock::time_point limit = now - std::chrono::seconds(LOST_AFTER);
+  for (auto it = stats.pending.begin(); it != stats.pending.end();)
+  {
+    if (it->second < limit)
+    {
+      it = stats.pending.erase(it);
+      stats.lost++;
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+// only starts connecting, the caller finishes it with client.loop().
+// So a broker that is slow to accept or answer does not stall the other meters.
+static bool connect_meter(VirtualMeter &meter)
+{
+  meter.client.setWill(meter.stateTopic, "[{\"variable\":\"state\",\"value\":\"offline\"}]");
+  return meter.client.connectAsync(options.host, options.port, meter.clientId, options.user, options.password);
+}
+
+static void publish(VirtualMeter &meter, const char *topic, const char *payload, size_t length)
+{
+  if (length == 0)
+  {
+    stats.errors++;
+    return;
+  }
+  std::string key;
+  if (options.latency)
+  {
+    // register before sending, the monitor may receive it before publish() returns
+    key = std::string(topic) + '\n' + std::string(payload, length);
+    std::lock_guard<std::mutex> guard(stats.lock);
+    stats.pending[key] = Clock::now();
+  }
+  if (meter.client.publish(topic, payload, length))
+  {
+    stats.sent++;
+    stats.sentBytes += length;
+    return;
+  }
+  stats.errors++;
+  if (options.latency)
+  {
+    std::lock_guard<std::mutex> guard(stats.lock);
+    stats.pending.erase(key);
+  }
+}
+
+// ADC sum of squares for one window with the given RMS current,
+// the inverse of amps_rms()
+static double adc_sum(float amps)
+{
+  double counts = (amps + INTERCEPT) / (VOLT_PER_BIT * SLOPE);
+  return counts * counts * SAMPLES_PER_WINDOW;
+}
+
+// metadata like meter_info() in the firmware. The simulated clock is not anchored to wall clock time.
+static MeterInfo meter_info(const VirtualMeter &meter)
+{
+  MeterInfo info = {};
+  info.wasmachine_id = meter.id;
+  info.sensor_id = meter.id;
+  info.session_id = meter.session_id;
+  info.this_cycle_time = meter.operating.lastCycleMillis() / 1000;
+  info.total_time_operated = meter.operating.operatedMillis() / 1000;
+  info.timestamp = (meter.simTime - WINDOW_MS) * 1000;
+  return info;
+}
+
+static uint64_t random_idle(VirtualMeter &meter)
+{
+  // at least END_OF_CYCLE + 1 minute, so cycles do not merge
+  uint64_t min = END_OF_CYCLE + 60000;
+  uint64_t max = std::max<uint64_t>(min, (uint64_t)options.idle * 60000);
+  std::uniform_int_distribution<uint64_t> idle(min, max);
+  return idle(meter.rng);
+}
+
+// one RMS window of the meter, like state 2 and 3 of the firmware loop
+static void step(VirtualMeter &meter)
+{
+  meter.simTime += WINDOW_MS;
+
+  float amps = 0.02;
+  if (!meter.washing && meter.simTime >= meter.nextProgram)
+  {
+    meter.profile.generate(meter.rng);
+    meter.programStart = meter.simTime;
+    meter.washing = true;
+  }
+  if (meter.washing)
+  {
+    uint64_t t = meter.simTime - meter.programStart;
+    amps = meter.profile.ampsAt(t, meter.rng);
+    if (t >= meter.profile.duration())
+    {
+      meter.washing = false;
+      meter.nextProgram = meter.simTime + random_idle(meter);
+    }
+  }
+
+  float AmpsRMS = amps_rms(adc_sum(amps), SAMPLES_PER_WINDOW, SLOPE, INTERCEPT);
+  CycleEvent event = meter.cycle.update(AmpsRMS, (meter.simTime - WINDOW_MS) * 1000, meter.simTime * 1000);
+  MeterInfo info = meter_info(meter);
+  char buffer[400];
+
+  // while disconnected the meter keeps measuring, publish() counts the lost messages as errors
+  if (event == CYCLE_STARTED)
+  {
+    info.cycle_start = meter.cycle.cycleStart();
+    publish(meter, meter.stateTopic, buffer, build_state_payload(buffer, sizeof(buffer), "1", info));
+    meter.session_id++;
+  }
+  meter.operating.update(meter.cycle, event);
+  info = meter_info(meter);
+  if (meter.cycle.running() || event == CYCLE_ENDED)
+  {
+    publish(meter, meter.topic, buffer, build_current_payload(buffer, sizeof(buffer), AmpsRMS, info));
+  }
+  if (event == CYCLE_ENDED)
+  {
+    info.cycle_start = meter.cycle.cycleStart();
+    info.cycle_end = meter.cycle.cycleEnd();
+    publish(meter, meter.stateTopic, buffer, build_state_payload(buffer, sizeof(buffer), "2", info));
+  }
+}
+
+// subscribes to all meter topics and matches every message with its send time
+static void monitor(MqttClient *client)
+{
+  MqttClient::Callback callback = [](const std::string &topic, const char *payload, size_t length)
+  {
+    Clock::time_point now = Clock::now();
+    stats.received++;
+    std::string key = topic + '\n' + std::string(payload, length);
+    std::lock_guard<std::mutex> guard(stats.lock);
+    auto it = stats.pending.find(key);
+    if (it == stats.pending.end())
+    {
+      return; // not ours, or a retained message
+    }
+    double latency = std::chrono::duration<double, std::milli>(now - it->second).count();
+    stats.latencies.add(latency);
+    stats.allLatencies.add(latency);
+    stats.pending.erase(it);
+  };
+  while (!stopping && client->loop(100, callback))
+    ;
+}
+
+static void usage(const char *name)
+{
+  printf("usage: %s [options]\n"
+         "  --host HOST       broker host (localhost)\n"
+         "  --port PORT       broker port (1883)\n"
+         "  --user USER       broker user name\n"
+         "  --password PASS   broker password\n"
+         "  --meters N        number of virtual meters (100)\n"
+         "  --first-id N      SENSOR_ID/WASMACHINE_ID of the first meter (1000)\n"
+         "  --prefix TOPIC    topic prefix, meters publish on PREFIX/ID and PREFIX/ID/state (sim)\n"
+         "  --speed X         simulated seconds per real second (60)\n"
+         "  --duration S      run time in real seconds (60)\n"
+         "  --report S        seconds between reports (5)\n"
+         "  --idle MIN        max simulated minutes between two cycles (30)\n"
+         "  --seed N          random seed (random)\n"
+         "  --no-latency      do not subscribe, only measure the publish side\n",
+         name);
+}
+
+static bool parse_options(int argc, char **argv)
+{
+  options.seed = std::random_device()();
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--no-latency")
+    {
+      options.latency = false;
+      continue;
+    }
+    if (i + 1 >= argc)
+    {
+      return false;
+    }
+    const char *value = argv[++i];
+    if (arg == "--host")
+      options.host = value;
+    else if (arg == "--port")
+      options.port = atoi(value);
+    else if (arg == "--user")
+      options.user = value;
+    else if (arg == "--password")
+      options.password = value;
+    else if (arg == "--meters")
+      options.meters = atoi(value);
+    else if (arg == "--first-id")
+      options.firstId = atoi(value);
+    else if (arg == "--prefix")
+      options.prefix = value;
+    else if (arg == "--speed")
+      options.speed = atof(value);
+    else if (arg == "--duration")
+      options.duration = atoi(value);
+    else if (arg == "--report")
+      options.report = atoi(value);
+    else if (arg == "--idle")
+      options.idle = atoi(value);
+    else if (arg == "--seed")
+      options.seed = strtoul(value, NULL, 10);
+    else
+      return false;
+  }
+  return options.meters > 0 && options.speed > 0 && options.duration > 0 && options.report > 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (!parse_options(argc, argv))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("fleet_sim: %d meters on %s:%u, speed %.0fx, seed %u\n",
+         options.meters, options.host, options.port, options.speed, options.seed);
+
+  MqttClient monitorClient;
+  std::thread monitorThread;
+  if (options.latency)
+  {
+    char topic[80];
+    snprintf(topic, sizeof(topic), "%s/#", options.prefix);
+    if (!monitorClient.connect(options.host, options.port, "sim_monitor", options.user, options.password) ||
+        !monitorClient.subscribe(topic))
+    {
+      printf("monitor: failed to connect to %s:%u\n", options.host, options.port);
+      return 1;
+    }
+    monitorThread = std::thread(monitor, &monitorClient);
+  }
+
+  // spread the windows of the meters over the period, like meters that booted at random times
+  Clock::duration period = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(WINDOW_MS / 1000.0 / options.speed));
+  Clock::time_point start = Clock::now();
+  std::mt19937 rng(options.seed);
+  std::uniform_int_distribution<Clock::rep> offset(0, period.count());
+  std::uniform_int_distribution<uint64_t> firstProgram(0, (uint64_t)options.idle * 60000);
+
+  std::vector<VirtualMeter> meters(options.meters);
+  int connected = 0;
+  for (int i = 0; i < options.meters; i++)
+  {
+    VirtualMeter &meter = meters[i];
+    meter.id = options.firstId + i;
+    meter.session_id = meter.id * 1000; // like SESSION_ID: 0000, 1000, 2000, ...
+    snprintf(meter.clientId, sizeof(meter.clientId), "sim_meter_%d", meter.id);
+    snprintf(meter.topic, sizeof(meter.topic), "%s/%d", options.prefix, meter.id);
+    snprintf(meter.stateTopic, sizeof(meter.stateTopic), "%s/%d/state", options.prefix, meter.id);
+    meter.rng.seed(options.seed + i);
+    meter.nextProgram = firstProgram(rng);
+    meter.nextConnect = start + std::chrono::seconds(RECONNECT_PERIOD);
+    connect_meter(meter);
+  }
+  // all meters connect at the same time, like a fleet after a power cut
+  bool waiting = true;
+  while (waiting && !stopping)
+  {
+    waiting = false;
+    for (VirtualMeter &meter : meters)
+    {
+      if (meter.client.connecting())
+      {
+        meter.client.loop(0);
+        waiting |= meter.client.connecting();
+      }
+    }
+    if (waiting)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  for (VirtualMeter &meter : meters)
+  {
+    connected += meter.client.connected();
+  }
+  printf("connected %d/%d meters in %.1f s\n", connected, options.meters,
+         std::chrono::duration<double>(Clock::now() - start).count());
+
+  start = Clock::now();
+  for (VirtualMeter &meter : meters)
+  {
+    meter.nextStep = start + Clock::duration(offset(rng));
+  }
+  Clock::time_point end = start + std::chrono::seconds(options.duration);
+  Clock::time_point nextReport = start + std::chrono::seconds(options.report);
+  Clock::time_point lastReport = start;
+  Clock::time_point nextKeepAlive = start + std::chrono::seconds(1);
+  uint64_t lastSent = 0, lastBytes = 0, lastReceived = 0;
+  double maxLag = 0; // ms the simulator itself is behind schedule
+
+  while (!stopping && Clock::now() < end)
+  {
+    Clock::time_point now = Clock::now();
+    Clock::time_point earliest = now + std::chrono::milliseconds(10);
+    for (VirtualMeter &meter : meters)
+    {
+      if (meter.client.connecting())
+      {
+        meter.client.loop(0);
+        if (meter.client.connected())
+        {
+          stats.reconnects++;
+        }
+      }
+      else if (!meter.client.connected() && now >= meter.nextConnect)
+      {
+        meter.nextConnect = now + std::chrono::seconds(RECONNECT_PERIOD);
+        connect_meter(meter);
+      }
+      if (meter.nextStep <= now)
+      {
+        maxLag = std::max(maxLag, std::chrono::duration<double, std::milli>(now - meter.nextStep).count());
+        // when overloaded, skip the oldest windows instead of catching up on all of them.
+        // The simulated time still passes, the meter just sends nothing for them.
+        uint64_t due = (now - meter.nextStep) / period + 1;
+        if (due > MAX_CATCH_UP)
+        {
+          uint64_t skip = due - MAX_CATCH_UP;
+          meter.simTime += skip * WINDOW_MS;
+          meter.nextStep += period * skip;
+          stats.dropped += skip;
+        }
+        while (meter.nextStep <= now)
+        {
+          step(meter);
+          meter.nextStep += period;
+        }
+      }
+      earliest = std::min(earliest, meter.nextStep);
+      if (Clock::now() >= end)
+      {
+        break;
+      }
+    }
+
+    if (now >= nextKeepAlive)
+    {
+      // drain PINGRESPs and send PINGREQs for meters that are idle
+      nextKeepAlive = now + std::chrono::seconds(1);
+      for (VirtualMeter &meter : meters)
+      {
+        meter.client.loop(0);
+      }
+    }
+
+    if (now >= nextReport)
+    {
+      // a pass can take long when overloaded, so do not use its start time
+      now = Clock::now();
+      double interval = std::chrono::duration<double>(now - lastReport).count();
+      uint64_t sent = stats.sent, bytes = stats.sentBytes, received = stats.received;
+      int running = 0;
+      connected = 0;
+      for (VirtualMeter &meter : meters)
+      {
+        running += meter.cycle.running();
+        connected += meter.client.connected();
+      }
+      printf("[%6.1f s] meters %d/%d, running %d | sent %.0f msg/s %.1f kB/s | recv %.0f msg/s | errors %llu | lag %.1f ms | dropped %llu | ",
+             std::chrono::duration<double>(now - start).count(), connected, options.meters, running,
+             (sent - lastSent) / interval, (bytes - lastBytes) / interval / 1000,
+             (received - lastReceived) / interval, (unsigned long long)stats.errors.load(), maxLag,
+             (unsigned long long)stats.dropped.load());
+      {
+        std::lock_guard<std::mutex> guard(stats.lock);
+        print_latency(stats.latencies);
+        stats.latencies.clear();
+        expire_pending(now);
+      }
+      printf("\n");
+      fflush(stdout);
+      lastSent = sent;
+      lastBytes = bytes;
+      lastReceived = received;
+      lastReport = now;
+      while (nextReport <= now)
+      {
+        nextReport += std::chrono::seconds(options.report);
+      }
+      maxLag = 0;
+    }
+
+    std::this_thread::sleep_until(earliest);
+  }
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  // give the broker time to deliver the last messages
+  if (options.latency)
+  {
+    std::this_thread::sleep_for(std::chrono::seconds(DRAIN_TIME));
+  }
+  stopping = true;
+  if (monitorThread.joinable())
+  {
+    monitorThread.join();
+  }
+  for (VirtualMeter &meter : meters)
+  {
+    meter.client.disconnect();
+  }
+
+  printf("summary: %.1f s, %d meters, sent %llu (%.0f msg/s, %.1f kB/s), errors %llu, reconnects %llu, dropped windows %llu\n",
+         elapsed, options.meters, (unsigned long long)stats.sent.load(), stats.sent / elapsed,
+         stats.sentBytes / elapsed / 1000, (unsigned long long)stats.errors.load(),
+         (unsigned long long)stats.reconnects.load(), (unsigned long long)stats.dropped.load());
+  if (options.latency)
+  {
+    std::lock_guard<std::mutex> guard(stats.lock);
+    printf("summary: received %llu, lost %llu, ", (unsigned long long)stats.received.load(),
+           (unsigned long long)(stats.lost + stats.pending.size()));
+    print_latency(stats.allLatencies);
+    printf("\n");
+  }
+  monitorClient.disconnect();
+  return 0;
+}
@@ -0,0 +1,451 @@
+#include "mqtt.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <chrono>
+
+// MQTT control packet types (upper nibble of the fixed header)
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_SUBSCRIBE 0x82 // flags 0010 are mandatory
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+#define MQTT_DISCONNECT 0xE0
+
+#define MQTT_IO_TIMEOUT 5000 // ms, for the TCP connect, the CONNACK and blocking sends
+
+static uint64_t now_ms()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void put_string(std::vector<uint8_t> &out, const char *str, size_t length)
+{
+  out.push_back(length >> 8);
+  out.push_back(length & 0xFF);
+  out.insert(out.end(), str, str + length);
+}
+
+static void put_string(std::vector<uint8_t> &out, const char *str)
+{
+  put_string(out, str, strlen(str));
+}
+
+// decode the remaining length of a fixed header.
+// returns the number of bytes used, 0 if more data is needed, -1 if invalid
+static int get_remaining_length(const uint8_t *data, size_t available, size_t &length)
+{
+  length = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    if ((size_t)i + 1 >= available)
+    {
+      return 0;
+    }
+    uint8_t digit = data[i + 1];
+    length |= (size_t)(digit & 0x7F) << (7 * i);
+    if ((digit & 0x80) == 0)
+    {
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+MqttClient::MqttClient()
+    : sock(-1), state(DISCONNECTED), stepStart(0), addresses(NULL), nextAddress(NULL),
+      keepAlive(60), packetId(0), lastSend(0)
+{
+}
+
+MqttClient::~MqttClient()
+{
+  disconnect();
+}
+
+void MqttClient::setWill(const char *topic, const char *payload)
+{
+  willTopic = topic;
+  willPayload = payload;
+}
+
+bool MqttClient::connect(const char *host, uint16_t port, const char *clientId,
+                         const char *user, const char *password, uint16_t keepAlive)
+{
+  if (!connectAsync(host, port, clientId, user, password, keepAlive))
+  {
+    return false;
+  }
+  while (connecting())
+  {
+    if (!loop(100))
+    {
+      return false;
+    }
+  }
+  return connected();
+}
+
+bool MqttClient::connectAsync(const char *host, uint16_t port, const char *clientId,
+                              const char *user, const char *password, uint16_t keepAlive)
+{
+  disconnect();
+  this->keepAlive = keepAlive;
+
+  connectBody.clear();
+  put_string(connectBody, "MQTT");
+  connectBody.push_back(4); // protocol level 3.1.1
+  uint8_t flags = 0x02; // clean session
+  if (!willTopic.empty())
+  {
+    flags |= 0x04 | 0x08 | 0x20; // will, will QoS 1, will retain
+  }
+  if (user != NULL)
+  {
+    flags |= 0x80;
+    if (password != NULL)
+    {
+      flags |= 0x40;
+    }
+  }
+  connectBody.push_back(flags);
+  connectBody.push_back(keepAlive >> 8);
+  connectBody.push_back(keepAlive & 0xFF);
+  put_string(connectBody, clientId);
+  if (!willTopic.empty())
+  {
+    put_string(connectBody, willTopic.c_str());
+    put_string(connectBody, willPayload.c_str());
+  }
+  if (user != NULL)
+  {
+    put_string(connectBody, user);
+    if (password != NULL)
+    {
+      put_string(connectBody, password);
+    }
+  }
+
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, service, &hints, &addresses) != 0)
+  {
+    addresses = NULL;
+    return false;
+  }
+  nextAddress = addresses;
+  return connectNext();
+}
+
+// start a non-blocking TCP connect to the next broker address.
+// A plain connect() can block for minutes when the broker drops SYNs,
+// which would stall all meters of the publisher loop.
+bool MqttClient::connectNext()
+{
+  while (nextAddress != NULL)
+  {
+    struct addrinfo *ai = nextAddress;
+    nextAddress = ai->ai_next;
+    sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sock < 0)
+    {
+      continue;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (::connect(sock, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+    {
+      state = TCP_CONNECTING;
+      stepStart = now_ms();
+      return true;
+    }
+    close(sock);
+    sock = -1;
+  }
+  closeSocket();
+  return false;
+}
+
+// advance a connection in TCP_CONNECTING. Returns false when it failed.
+bool MqttClient::connectStep(int timeoutMs)
+{
+  struct pollfd pfd = {sock, POLLOUT, 0};
+  int ready = poll(&pfd, 1, timeoutMs);
+  if (ready < 0)
+  {
+    return errno == EINTR;
+  }
+  if (ready == 0)
+  {
+    if (now_ms() - stepStart < MQTT_IO_TIMEOUT)
+    {
+      return true;
+    }
+    // timeout, try the next address
+    close(sock);
+    sock = -1;
+    return connectNext();
+  }
+  int error = 0;
+  socklen_t size = sizeof(error);
+  getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &size);
+  if (error != 0)
+  {
+    close(sock);
+    sock = -1;
+    return connectNext();
+  }
+
+  // connected: blocking sends with a timeout from here on
+  freeaddrinfo(addresses);
+  addresses = nextAddress = NULL;
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+  int one = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  struct timeval tv = {MQTT_IO_TIMEOUT / 1000, 0};
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  state = WAIT_CONNACK;
+  stepStart = now_ms();
+  if (!sendPacket(MQTT_CONNECT, connectBody))
+  {
+    return false;
+  }
+  return true;
+}
+
+void MqttClient::disconnect()
+{
+  if (state == CONNECTED)
+  {
+    uint8_t packet[2] = {MQTT_DISCONNECT, 0};
+    send(sock, packet, sizeof(packet), MSG_NOSIGNAL);
+  }
+  closeSocket();
+}
+
+// drop the connection without a DISCONNECT, also while connecting
+void MqttClient::closeSocket()
+{
+  if (sock >= 0)
+  {
+    close(sock);
+    sock = -1;
+  }
+  if (addresses != NULL)
+  {
+    freeaddrinfo(addresses);
+    addresses = nextAddress = NULL;
+  }
+  state = DISCONNECTED;
+  rx.clear();
+}
+
+bool MqttClient::sendPacket(uint8_t header, const std::vector<uint8_t> &body)
+{
+  if (sock < 0)
+  {
+    return false;
+  }
+  std::vector<uint8_t> packet;
+  packet.reserve(body.size() + 5);
+  packet.push_back(header);
+  size_t length = body.size();
+  do
+  {
+    uint8_t digit = length & 0x7F;
+    length >>= 7;
+    if (length > 0)
+    {
+      digit |= 0x80;
+    }
+    packet.push_back(digit);
+  } while (length > 0);
+  packet.insert(packet.end(), body.begin(), body.end());
+
+  size_t sent = 0;
+  while (sent < packet.size())
+  {
+    ssize_t n = send(sock, packet.data() + sent, packet.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      // error or send timeout, the connection is not usable anymore
+      closeSocket();
+      return false;
+    }
+    sent += n;
+  }
+  lastSend = now_ms();
+  return true;
+}
+
+bool MqttClient::publish(const char *topic, const char *payload, size_t length)
+{
+  if (state != CONNECTED)
+  {
+    return false;
+  }
+  std::vector<uint8_t> body;
+  body.reserve(strlen(topic) + length + 2);
+  put_string(body, topic);
+  body.insert(body.end(), payload, payload + length);
+  return sendPacket(MQTT_PUBLISH, body);
+}
+
+bool MqttClient::subscribe(const char *topic)
+{
+  if (state != CONNECTED)
+  {
+    return false;
+  }
+  std::vector<uint8_t> body;
+  packetId++;
+  if (packetId == 0)
+  {
+    packetId = 1;
+  }
+  body.push_back(packetId >> 8);
+  body.push_back(packetId & 0xFF);
+  put_string(body, topic);
+  body.push_back(0); // QoS 0
+  // the SUBACK is skipped by loop()
+  return sendPacket(MQTT_SUBSCRIBE, body);
+}
+
+void MqttClient::keepAliveCheck()
+{
+  if (state == CONNECTED && keepAlive > 0 && now_ms() - lastSend >= (uint64_t)keepAlive * 1000 / 2)
+  {
+    sendPacket(MQTT_PINGREQ, std::vector<uint8_t>());
+  }
+}
+
+bool MqttClient::loop(int timeoutMs, const Callback &callback)
+{
+  if (state == TCP_CONNECTING)
+  {
+    return connectStep(timeoutMs);
+  }
+  if (state == WAIT_CONNACK && now_ms() - stepStart >= MQTT_IO_TIMEOUT)
+  {
+    closeSocket();
+    return false;
+  }
+  keepAliveCheck();
+  if (sock < 0)
+  {
+    return false;
+  }
+  struct pollfd pfd = {sock, POLLIN, 0};
+  int ready = poll(&pfd, 1, timeoutMs);
+  if (ready < 0)
+  {
+    return errno == EINTR;
+  }
+  if (ready == 0)
+  {
+    return true;
+  }
+
+  uint8_t buffer[16384];
+  ssize_t n = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+  {
+    closeSocket();
+    return false;
+  }
+  if (n > 0)
+  {
+    rx.insert(rx.end(), buffer, buffer + n);
+  }
+
+  // parse all complete packets in the receive buffer
+  size_t offset = 0;
+  while (offset < rx.size())
+  {
+    size_t length;
+    int used = get_remaining_length(rx.data() + offset, rx.size() - offset, length);
+    if (used < 0)
+    {
+      disconnect();
+      return false;
+    }
+    if (used == 0 || rx.size() - offset < 1 + used + length)
+    {
+      break;
+    }
+    if (!handlePacket(rx[offset], rx.data() + offset + 1 + used, length, callback))
+    {
+      disconnect();
+      return false;
+    }
+    offset += 1 + used + length;
+  }
+  rx.erase(rx.begin(), rx.begin() + offset);
+  return true;
+}
+
+bool MqttClient::handlePacket(uint8_t header, const uint8_t *body, size_t length, const Callback &callback)
+{
+  switch (header & 0xF0)
+  {
+  case MQTT_PUBLISH:
+  {
+    if (length < 2)
+    {
+      return false;
+    }
+    size_t topicLength = (body[0] << 8) | body[1];
+    size_t payloadStart = 2 + topicLength;
+    // QoS 1 and 2 messages carry a packet identifier. We only subscribe with QoS 0,
+    // so the broker never sends those, but skip it to be safe.
+    if (header & 0x06)
+    {
+      payloadStart += 2;
+    }
+    if (payloadStart > length)
+    {
+      return false;
+    }
+    if (callback)
+    {
+      std::string topic((const char *)body + 2, topicLength);
+      callback(topic, (const char *)body + payloadStart, length - payloadStart);
+    }
+    return true;
+  }
+  case MQTT_CONNACK:
+    // 0x20 0x02 <session present> <return code>
+    if (state != WAIT_CONNACK || length != 2 || body[1] != 0)
+    {
+      return false;
+    }
+    state = CONNECTED;
+    return true;
+  case MQTT_SUBACK:
+  case MQTT_PINGRESP:
+    return true;
+  default:
+    // nothing else is expected for a QoS 0 client
+    return true;
+  }
+}
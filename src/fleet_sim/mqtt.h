@@ -0,0 +1,78 @@
+// Minimal MQTT 3.1.1 client for the fleet simulator.
+// QoS 0 publish/subscribe over a plain TCP socket (POSIX), which is
+// all the meters use. Not thread safe: use one client per thread.
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct addrinfo;
+
+class MqttClient
+{
+public:
+  // topic, payload, payload length
+  typedef std::function<void(const std::string &, const char *, size_t)> Callback;
+
+  MqttClient();
+  ~MqttClient();
+  MqttClient(const MqttClient &) = delete;
+  MqttClient &operator=(const MqttClient &) = delete;
+
+  // set the last will message before connect(). Sent with QoS 1, retained,
+  // like the LWT of the meters.
+  void setWill(const char *topic, const char *payload);
+
+  // connect and wait for the CONNACK. user and password may be NULL.
+  bool connect(const char *host, uint16_t port, const char *clientId,
+               const char *user, const char *password, uint16_t keepAlive = 60);
+  // start connecting without waiting, loop() finishes the connection.
+  // Only the name lookup blocks, use an IP address for a remote broker.
+  // Returns false when no connection could be started.
+  bool connectAsync(const char *host, uint16_t port, const char *clientId,
+                    const char *user, const char *password, uint16_t keepAlive = 60);
+  void disconnect();
+  bool connected() const { return state == CONNECTED; }
+  bool connecting() const { return state == TCP_CONNECTING || state == WAIT_CONNACK; }
+
+  bool publish(const char *topic, const char *payload, size_t length);
+  bool subscribe(const char *topic);
+
+  // read incoming packets for at most timeoutMs and pass every PUBLISH to
+  // callback. Also sends a PINGREQ when the keep alive is due.
+  // While connecting, advances the connection instead.
+  // Returns false when the connection was lost or could not be made.
+  bool loop(int timeoutMs, const Callback &callback = Callback());
+
+private:
+  enum State
+  {
+    DISCONNECTED,
+    TCP_CONNECTING, // waiting for the TCP connect
+    WAIT_CONNACK,   // CONNECT sent
+    CONNECTED
+  };
+
+  bool connectNext();
+  bool connectStep(int timeoutMs);
+  void closeSocket();
+  bool sendPacket(uint8_t header, const std::vector<uint8_t> &body);
+  bool handlePacket(uint8_t header, const uint8_t *body, size_t length, const Callback &callback);
+  void keepAliveCheck();
+
+  int sock;
+  State state;
+  uint64_t stepStart;               // ms, start of the current connection step
+  struct addrinfo *addresses;       // broker addresses while connecting
+  struct addrinfo *nextAddress;     // next one to try
+  std::vector<uint8_t> connectBody; // CONNECT packet, sent once the TCP connection is up
+  uint16_t keepAlive;
+  uint16_t packetId;
+  uint64_t lastSend; // ms, steady clock
+  std::string willTopic;
+  std::string willPayload;
+  std::vector<uint8_t> rx; // bytes received but not parsed yet
+};
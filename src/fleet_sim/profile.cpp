@@ -0,0 +1,80 @@
+#include "profile.h"
+
+#define IDLE_AMPS 0.02 // standby current, below the meter treshold
+
+void WashProfile::add(PhaseKind kind, uint64_t minutesMin, uint64_t minutesMax, float amps, std::mt19937 &rng)
+{
+  std::uniform_int_distribution<uint64_t> seconds(minutesMin * 60, minutesMax * 60);
+  Phase phase = {kind, seconds(rng) * 1000, amps};
+  phases.push_back(phase);
+  total += phase.duration;
+}
+
+void WashProfile::generate(std::mt19937 &rng)
+{
+  phases.clear();
+  total = 0;
+  std::uniform_int_distribution<int> program(0, 2);
+  std::uniform_int_distribution<int> rinses(2, 3);
+  std::uniform_real_distribution<float> motor(0.6, 1.2);
+  std::uniform_real_distribution<float> heater(8.5, 9.5); // ~2 kW element
+
+  add(PHASE_FILL, 2, 4, 0.1, rng);
+  switch (program(rng))
+  {
+  case 1: // 40 degrees
+    add(PHASE_HEAT, 8, 12, heater(rng), rng);
+    break;
+  case 2: // 60 degrees
+    add(PHASE_HEAT, 15, 25, heater(rng), rng);
+    break;
+  default: // cold
+    break;
+  }
+  add(PHASE_WASH, 20, 40, motor(rng), rng);
+  add(PHASE_DRAIN, 1, 2, 0.3, rng);
+  for (int i = rinses(rng); i > 0; i--)
+  {
+    add(PHASE_FILL, 1, 3, 0.1, rng);
+    add(PHASE_WASH, 4, 6, motor(rng), rng);
+    add(PHASE_DRAIN, 1, 2, 0.3, rng);
+  }
+  add(PHASE_SPIN, 5, 10, 3.5, rng);
+}
+
+float WashProfile::ampsAt(uint64_t t, std::mt19937 &rng) const
+{
+  std::normal_distribution<float> noise(0, 0.02);
+  float amps = IDLE_AMPS;
+  for (const Phase &phase : phases)
+  {
+    if (t >= phase.duration)
+    {
+      t -= phase.duration;
+      continue;
+    }
+    uint64_t second = t / 1000;
+    switch (phase.kind)
+    {
+    case PHASE_FILL:
+    case PHASE_DRAIN:
+      amps = phase.amps;
+      break;
+    case PHASE_HEAT:
+      // drum turns 10 s every minute while heating
+      amps = phase.amps + ((second % 60) < 10 ? 0.6 : 0);
+      break;
+    case PHASE_WASH:
+      // 12 s turning, 4 s pause
+      amps = (second % 16) < 12 ? phase.amps : 0.1;
+      break;
+    case PHASE_SPIN:
+      // ramp up during the first 2 minutes
+      amps = second < 120 ? 1.0 + (phase.amps - 1.0) * second / 120 : phase.amps;
+      break;
+    }
+    break;
+  }
+  amps += noise(rng);
+  return amps < 0 ? 0 : amps;
+}
@@ -0,0 +1,44 @@
+// Wash cycle current profiles for the fleet simulator.
+// Rough model of a 230 V household washing machine: fill, heat,
+// wash, rinse, spin. Durations and currents vary per cycle.
+#pragma once
+
+#include <stdint.h>
+#include <random>
+#include <vector>
+
+enum PhaseKind
+{
+  PHASE_FILL,   // water valve and electronics only
+  PHASE_HEAT,   // heating element, drum turning now and then
+  PHASE_WASH,   // drum motor, turning left/right with pauses
+  PHASE_DRAIN,  // drain pump
+  PHASE_SPIN    // drum motor ramping up
+};
+
+struct Phase
+{
+  PhaseKind kind;
+  uint64_t duration; // ms
+  float amps;        // nominal RMS current
+};
+
+class WashProfile
+{
+public:
+  // build a random program: cold, 40 or 60 degrees, with 2 or 3 rinses
+  void generate(std::mt19937 &rng);
+
+  // total length of the program in ms
+  uint64_t duration() const { return total; }
+
+  // RMS current t ms after the start of the program, with some noise.
+  // Returns the idle current after the end of the program.
+  float ampsAt(uint64_t t, std::mt19937 &rng) const;
+
+private:
+  void add(PhaseKind kind, uint64_t minutesMin, uint64_t minutesMax, float amps, std::mt19937 &rng);
+
+  std::vector<Phase> phases;
+  uint64_t total = 0;
+};
@@ -8,7 +8,10 @@
 #include <ESPmDNS.h>
 #include <ADS1X15.h>
 #include <LiquidCrystal_I2C.h>
+#include <esp_timer.h>
+#include <sys/time.h>
 #include "secrets.h"
+#include <meter.h>
 
 //#define TAGO
 #define LOCAL
@@ -17,9 +20,26 @@
 #define LOCAL_BROKER_PORT 1883
 #define PUB_TOPIC "meter2"
 #define STATE_TOPIC "meter2/state"
+#define HEALTH_TOPIC "meter2/health"
+#define MQTT_BUFFER_SIZE 512 // PubSubClient packet size, the default of 256 is too small
+#define PAYLOAD_SIZE 400
 
-#define END_OF_CYCLE 360000 // 3 minutes treshold
-#define CYCLE_TRESHOLD 0.2
+// anchor the message timestamps to wall clock time with SNTP
+#define SNTP
+#define NTP_SERVER "pool.ntp.org"
+
+// END_OF_CYCLE and CYCLE_TRESHOLD are defined in lib/meter/meter.h
+
+// fast boot: start sampling right after power-on and bring up
+// WiFi, mDNS, OTA and MQTT in the background from loop().
+// comment out to use the old blocking startup.
+#define FAST_BOOT
+#define NET_RETRY_PERIOD 5000 // ms between WiFi and MQTT connection attempts
+#define MQTT_FAILS_BEFORE_DNS 3 // failed MQTT attempts before the broker names are resolved again
+// PubSubClient::connect() blocks, so the broker names are resolved in dns_task()
+// and the connection attempts run in mqtt_task(). MQTT_CONNECT_TIMEOUT caps the
+// TCP connect and the CONNACK wait of one attempt.
+#define MQTT_CONNECT_TIMEOUT 1 // s
 
 
 
@@ -65,15 +85,13 @@ float intercept = 0.07;
 //constructor for measuring VDD
 float measure_vdd(void);
 
-unsigned long startTime = 0; // Variable to store the start time
-unsigned long elapsedTime;
-unsigned long elapsed_sec;
 unsigned long printPeriod = 1000; // in milliseconds
 
-// Track time in milliseconds since last reading
-unsigned long previousMillis = 0;
-unsigned long lastSample = 0;
-unsigned long EndOfCycle = 0;
+// Sample timestamps in µs from esp_timer_get_time().
+// 64 bit and monotonic, so they never overflow like micros() and millis().
+uint64_t lastSample = 0;
+uint64_t windowStart = 0; // first sample of the current RMS window
+uint64_t windowEnd = 0;   // last sample of the current RMS window
 
 const char *ssid = STASSID;
 const char *password = STAPSK;
@@ -116,16 +134,18 @@ uint32_t session_id = SESSION_ID;
 
 float ADC_vdd = 0;
 
-int device_state;
-int prev_device_state;
+// cycle detection, shared with the fleet simulator
+CycleDetector cycle;
 
 // SPIFFS function definitions
+// all times in integer ms, kept by OperatingTime (lib/meter)
 struct HoursOfOperationData
 {
-  unsigned long lastUpdate;       // Last update time (Unix timestamp)
-  unsigned long hoursOfOperation; // Total hours of operation
+  uint64_t lastCycleMillis; // duration of the last (or current) cycle
+  uint64_t operatedMillis;  // total time of operation
 };
 HoursOfOperationData init_time;
+OperatingTime operating;
 uint32_t readNumberFile(fs::FS &fs, const char *path);
 HoursOfOperationData readTimeFromFile(fs::FS &fs, const char *counterfile);
 void writeTimeToFile(fs::FS &fs, const char *counterfile, const HoursOfOperationData &data);
@@ -135,8 +155,82 @@ const char *sessionfilename = "/session_id.txt";
 
 HoursOfOperationData TimeData;
 
+uint64_t wallclock_ms(uint64_t timestamp);
+MeterInfo meter_info();
+
+// state messages that could not be sent yet. In fast boot mode network_task() sends
+// them once the broker is connected, so a cycle detected during bring-up is not lost.
+// ON and OFF alternate, so the last two always hold the last ON and OFF.
+#define PENDING_STATES 2
+struct PendingStates
+{
+  char payload[PENDING_STATES][PAYLOAD_SIZE];
+  int first; // oldest message
+  int count;
+};
+#ifdef TAGO
+PendingStates tago_pending;
+#endif
+#ifdef LOCAL
+PendingStates local_pending;
+#endif
+
+bool mqtt_ready();
+bool publish_state(PubSubClient &client, PendingStates &pending, const char *payload);
+void flush_states(PubSubClient &client, PendingStates &pending);
+
 void setup_wifi();
 void connect_mqtt();
+void setup_ota();
+
+#ifdef FAST_BOOT
+// background network bring-up, advanced by network_task() every loop.
+enum NetState
+{
+  NET_WIFI, // waiting for WiFi to connect
+  NET_MDNS, // starting mDNS and OTA
+  NET_DNS,  // resolving the broker name(s) in dns_task()
+  NET_MQTT, // connecting to the broker(s) in mqtt_task()
+  NET_READY // everything up, keep the clients alive
+};
+NetState net_state = NET_WIFI;
+bool wifi_started = false;
+bool first_window_done = false; // set in state 3, WiFi is started after the first window
+bool ota_started = false;
+unsigned long lastNetAttempt = 0;
+int mqttFailures = 0; // failed attempts since the last DNS lookup
+
+// broker addresses, written by dns_task()
+bool dns_started = false;
+volatile bool dns_done = false;
+volatile bool dns_ok = false;
+// result of mqtt_task()
+bool mqtt_started = false;
+volatile bool mqtt_done = false;
+volatile bool mqtt_ok = false;
+#ifdef TAGO
+IPAddress tago_ip;
+#endif
+#ifdef LOCAL
+IPAddress local_ip;
+#endif
+
+// boot timing for the health message. 0 = not reached yet.
+// esp_timer_get_time() and millis() start when the application starts, so the
+// time spent in the ROM and second stage bootloader before that is not included.
+uint64_t firstSampleMicros = 0; // time to first ADC sample in µs since app start
+unsigned long wifiReadyMillis = 0;
+unsigned long otaReadyMillis = 0;
+unsigned long mqttReadyMillis = 0;
+
+void start_wifi();
+void dns_task(void *parameter);
+void mqtt_task(void *parameter);
+bool try_connect_mqtt();
+bool mqtt_connected();
+void network_task();
+void publish_health();
+#endif
 
 
 void setup()
@@ -153,6 +247,24 @@ void setup()
   lcd.init();      // init the LCD
   lcd.backlight(); // Turn on the backlight on LCD.
 
+  // room for the timestamps in the messages
+  #ifdef TAGO
+  tago_client.setBufferSize(MQTT_BUFFER_SIZE);
+  #endif
+  #ifdef LOCAL
+  local_client.setBufferSize(MQTT_BUFFER_SIZE);
+  #endif
+#ifdef FAST_BOOT
+  // cap the time of one connection attempt in mqtt_task()
+  espClient.setTimeout(MQTT_CONNECT_TIMEOUT);
+  #ifdef TAGO
+  tago_client.setSocketTimeout(MQTT_CONNECT_TIMEOUT);
+  #endif
+  #ifdef LOCAL
+  local_client.setSocketTimeout(MQTT_CONNECT_TIMEOUT);
+  #endif
+#endif
+
   // start the filesystem. If there is an error, loop infinitely.
   if (!SPIFFS.begin(true))
   {
@@ -175,16 +287,17 @@ void setup()
         ;
     }
     else
-    init_time.hoursOfOperation = 0;
-    init_time.lastUpdate = 0;
+    init_time.operatedMillis = 0;
+    init_time.lastCycleMillis = 0;
     writeTimeToFile(SPIFFS, counterfilename, init_time);
     file.close();
   }
   TimeData = readTimeFromFile(SPIFFS, counterfilename);
+  operating = OperatingTime(TimeData.operatedMillis, TimeData.lastCycleMillis);
 
   //RESET TIME
-  //  init_time.hoursOfOperation = 0;
-  //  init_time.lastUpdate = 0;
+  //  init_time.operatedMillis = 0;
+  //  init_time.lastCycleMillis = 0;
   //  writeTimeToFile(SPIFFS, counterfilename, init_time);
 
   // Check if the session ID file exists.
@@ -209,6 +322,11 @@ void setup()
   //writeNumberToFile(SPIFFS, sessionfilename, SESSION_ID);
   
   lcd.print("EcoWashMate");
+#ifdef FAST_BOOT
+  // state 0 measures Vdd before the first window, and network_task()
+  // starts WiFi once the first window is done. Nothing else to wait for.
+  Serial.println("Fast boot: WiFi starts after the first window");
+#else
   // Show welcome message. Meanwhile wait for vdd to stabilise
   delay(2000);
   lcd.clear();
@@ -227,6 +345,10 @@ void setup()
   Serial.println("Setup WiFi and MQTT");
   setup_wifi();
   connect_mqtt();
+#ifdef SNTP
+  // UTC. SNTP syncs in the background.
+  configTime(0, 0, NTP_SERVER);
+#endif
 
   // reset ADC values for measuring current
   ADS.reset();
@@ -234,9 +356,26 @@ void setup()
   ADS.setDataRate(7); // 0 = slow   4 = medium   7 = fast
   ADS.setMode(0);     // continuous mode
   ADS.readADC(0);     // first read to trigger ADC
-  startTime = millis();
+#endif
+
+  setup_ota();
+#ifdef FAST_BOOT
+  Serial.printf("Setup done after %lu ms, sampling starts\n", millis());
+#else
+  ArduinoOTA.begin();
+
+  Serial.println("Ready");
+  Serial.print("IP address: ");
+  Serial.println(WiFi.localIP());
+  lcd.setCursor(0,1);
+  lcd.print(WiFi.localIP());
+#endif
+}
 
-    ArduinoOTA
+// register the OTA callbacks. ArduinoOTA.begin() is called once WiFi is up.
+void setup_ota()
+{
+  ArduinoOTA
     .onStart([]() {
       String type;
       if (ArduinoOTA.getCommand() == U_FLASH)
@@ -261,14 +400,6 @@ void setup()
       else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
       else if (error == OTA_END_ERROR) Serial.println("End Failed");
     });
-
-  ArduinoOTA.begin();
-
-  Serial.println("Ready");
-  Serial.print("IP address: ");
-  Serial.println(WiFi.localIP());
-  lcd.setCursor(0,1);
-  lcd.print(WiFi.localIP());
 }
 
 void loop()
@@ -277,10 +408,14 @@ void loop()
   {
     //every cycle: check for OTA update requests
     ArduinoOTA.handle();
+#ifdef FAST_BOOT
+    // every cycle: advance the network bring-up without blocking
+    network_task();
+#endif
     // state 0: calibrate Vdd and check if wifi/mqtt is connected
     if (state == 0)
     {
-      
+#ifndef FAST_BOOT
       if (!WiFi.isConnected()){
         WiFi.reconnect();
       }
@@ -294,6 +429,7 @@ void loop()
         connect_mqtt();
       }
       #endif 
+#endif
       ADC_vdd =  measure_vdd();
       ADS.reset();
       ADS.setGain(0);     // 6.144 volt
@@ -306,7 +442,6 @@ void loop()
     if (state == 1)
     {
       state = 2;
-      previousMillis = millis();
       sum = 0;
       samples = 0;
     }
@@ -315,32 +450,35 @@ void loop()
     // Add every measurement to sum.
     if (state == 2)
     {
-      uint32_t now = micros();
+      uint64_t now = esp_timer_get_time();
       if (now - lastSample >= 1160) //  almost exact 860 SPS
       {
         lastSample = now;
         ADC_value = ADS.getValue();
+        if (samples == 0)
+        {
+          windowStart = now;
+        }
+        windowEnd = now;
+#ifdef FAST_BOOT
+        if (firstSampleMicros == 0)
+        {
+          firstSampleMicros = now;
+          Serial.printf("First sample after %llu us\n", firstSampleMicros);
+        }
+#endif
         ADC_value = ADC_value - (ADC_vdd / 2);
         sum = sum + (ADC_value * ADC_value); // square value
         samples++;
       }
-      if ((millis() - previousMillis) >= printPeriod)
+      if (samples > 0 && (now - windowStart) >= (uint64_t)printPeriod * 1000)
       {                            // every printPeriod we do the calculation
-        previousMillis = millis(); //   update time
-        sum = sum / samples;       // get the average current measured
         // Serial.println(samples);
         // Serial.println(sum);
         Serial.print("current: ");
         Serial.print(AmpsRMS);
         Serial.println(" amps RMS");
-        // calculate the RMS value. square root sum, multiply by voltage per value and multiply by slope (mV/A).
-        // intercept is the zero adjustment.
-        AmpsRMS = (sqrt(sum) * (6.144 / 32768) * slope) - intercept;
-
-        if (AmpsRMS < 0)
-        {
-          AmpsRMS = 0;
-        }
+        AmpsRMS = amps_rms(sum, samples, slope, intercept);
         lcd.setCursor(0, 0);
         lcd.print("current= ");
         lcd.print(AmpsRMS);
@@ -354,6 +492,10 @@ void loop()
     // state 3: send the values to MQTT broker
     if (state == 3)
     {
+#ifdef FAST_BOOT
+      first_window_done = true;
+#endif
+#ifndef FAST_BOOT
       //reconnect if connection is lost
       if (!WiFi.isConnected()){
         WiFi.reconnect();
@@ -368,127 +510,106 @@ void loop()
           connect_mqtt();
         }
         #endif 
+#endif
       
 
-      Serial.print(device_state);
-      // IF the device is OFF and the current is more than 0,5A
-      // THEN update the device state to ON, and publish the state on the broker
-      if (AmpsRMS >= CYCLE_TRESHOLD && device_state == 0)
+      Serial.print(cycle.state());
+      CycleEvent event = cycle.update(AmpsRMS, windowStart, windowEnd);
+      MeterInfo info = meter_info();
+      char JSONmessageBuffer[PAYLOAD_SIZE];
+
+      // IF the device is OFF and the current is more than CYCLE_TRESHOLD
+      // THEN publish the state on the broker
+      if (event == CYCLE_STARTED)
       {
-        device_state = 1;
-        StaticJsonDocument<200> JSONbuffer;
-        JsonArray array = JSONbuffer.to<JsonArray>();
-        JsonObject state = array.createNestedObject();
-        state["variable"] = "state";
-        state["value"] = "1"; // 1 = ON
-        state["group"] = String(session_id);
-        JsonObject meta = state.createNestedObject("metadata");
-        meta["wasmachine_id"] = WASMACHINE_ID;
-        meta["sensor_id"] = WASMACHINE_ID;
-        meta["this_cycle_time"] = elapsed_sec;
-        meta["total_time_operated"] = TimeData.hoursOfOperation;
-        char JSONmessageBuffer[200];
-        serializeJson(JSONbuffer, JSONmessageBuffer);
-        #ifdef TAGO
-        if (tago_client.publish(STATE_TOPIC, JSONmessageBuffer) == true)
+        info.cycle_start = cycle.cycleStart();
+        if (build_state_payload(JSONmessageBuffer, sizeof(JSONmessageBuffer), "1", info) == 0) // 1 = ON
         {
-          Serial.println("The cycle has started");
-          lcd.setCursor(0,1);
-          lcd.print("cycle started");
+          Serial.println("Error: state message too large, not sent");
         }
-        #endif
-        #ifdef LOCAL
-        if (local_client.publish(STATE_TOPIC, JSONmessageBuffer) == true){
-          Serial.println("published to local client");
+        else
+        {
+          #ifdef TAGO
+          if (publish_state(tago_client, tago_pending, JSONmessageBuffer) == true)
+          {
+            Serial.println("The cycle has started");
+            lcd.setCursor(0,1);
+            lcd.print("cycle started");
+          }
+          #endif
+          #ifdef LOCAL
+          if (publish_state(local_client, local_pending, JSONmessageBuffer) == true){
+            Serial.println("published to local client");
+          }
+          #endif
         }
-        #endif
 
-        
+        // increment session ID and write it to file
+        session_id = session_id + 1;
+        writeNumberToFile(SPIFFS, sessionfilename, session_id);
       }
 
-      // IF the device state has changed from OFF to ON, increment session ID and write it to file, update start time
-      if (device_state == 1)
+      // If device is on, record the time that it was on. Only write when it changed.
+      if (operating.update(cycle, event))
       {
-        session_id = session_id + 1;
-        writeNumberToFile(SPIFFS, sessionfilename, session_id);
-        device_state = 2;
-        startTime = millis();
-        elapsedTime = 0;
-        elapsed_sec = 0;
-        //read the value of Timedata from FS.
-        TimeData = readTimeFromFile(SPIFFS, counterfilename);
+        TimeData.lastCycleMillis = operating.lastCycleMillis();
+        TimeData.operatedMillis = operating.operatedMillis();
+        writeTimeToFile(SPIFFS, counterfilename, TimeData);
       }
+      info = meter_info();
 
-      // Only send sensor data if the machine is ON
+      // Only send sensor data if the machine is ON, including the last window of the cycle
       // send the value in mA as INT.
-      if (device_state == 2 || device_state == 3)
+      if (cycle.running() || event == CYCLE_ENDED)
       {
-        StaticJsonDocument<200> JSONbuffer;               // make a json object
-        JsonArray array = JSONbuffer.to<JsonArray>();     // create an array
-        JsonObject amperage = array.createNestedObject(); // create a nested object in the array
-        amperage["variable"] = "current";                 // add the variable info
-        amperage["group"] = String(session_id);
-        amperage["unit"] = "mA";
-        amperage["value"] = int(AmpsRMS * 1000);
-        JsonObject metadata = amperage.createNestedObject("metadata");
-        metadata["sensor_id"] = SENSOR_ID;
-        metadata["wasmachine_id"] = WASMACHINE_ID;
-        metadata["this_cycle_time"] = elapsed_sec;
-        metadata["total_time_operated"] = TimeData.hoursOfOperation;
-        char JSONmessageBuffer[200];
-        serializeJson(JSONbuffer, JSONmessageBuffer);
-        // publish the serialised buffer to the broker
-        #ifdef TAGO
-        if (tago_client.publish(PUB_TOPIC, JSONmessageBuffer) == true)
+        if (build_current_payload(JSONmessageBuffer, sizeof(JSONmessageBuffer), AmpsRMS, info) == 0)
         {
-          Serial.println("Success sending message");
+          Serial.println("Error: current message too large, not sent");
         }
-        else
+        else if (!mqtt_ready())
         {
-          Serial.println("Error sending message");
-        }
-        #endif
-        #ifdef LOCAL
-        if (local_client.publish(PUB_TOPIC, JSONmessageBuffer) == true)
-        {
-          Serial.println("published to local client");
+          Serial.println("MQTT not connected, current message not sent");
         }
         else
         {
-          Serial.println("Error sending message to local client");
+          // publish the serialised buffer to the broker
+          #ifdef TAGO
+          if (tago_client.publish(PUB_TOPIC, JSONmessageBuffer) == true)
+          {
+            Serial.println("Success sending message");
+          }
+          else
+          {
+            Serial.println("Error sending message");
+          }
+          #endif
+          #ifdef LOCAL
+          if (local_client.publish(PUB_TOPIC, JSONmessageBuffer) == true)
+          {
+            Serial.println("published to local client");
+          }
+          else
+          {
+            Serial.println("Error sending message to local client");
+          }
+          #endif
         }
-        #endif
       }
-      // IF the device is ON and the current is less than 0,5A for END_OF_CYCLE ms
-      // THEN update the device state to OFF, and publish the state on the broker
-      
-      if (AmpsRMS < CYCLE_TRESHOLD && device_state == 2)
+
+      // IF the current was less than CYCLE_TRESHOLD for END_OF_CYCLE ms
+      // THEN publish the state on the broker
+      if (event == CYCLE_ENDED)
       {
-        device_state = 3;
-        EndOfCycle = millis();
-      }
-      if (device_state == 3){
-        if (AmpsRMS >= CYCLE_TRESHOLD){
-          device_state = 2;
+        info.cycle_start = cycle.cycleStart();
+        info.cycle_end = cycle.cycleEnd();
+        if (build_state_payload(JSONmessageBuffer, sizeof(JSONmessageBuffer), "2", info) == 0) //2 = OFF
+        {
+          Serial.println("Error: state message too large, not sent");
         }
-        if ((millis() - EndOfCycle) >= END_OF_CYCLE)
+        else
         {
-          device_state = 0;
-          StaticJsonDocument<200> JSONbuffer;
-          JsonArray array = JSONbuffer.to<JsonArray>();
-          JsonObject state = array.createNestedObject();
-          state["variable"] = "state";
-          state["value"] = "2"; //2 = OFF
-          state["group"] = String(session_id);
-          JsonObject meta = state.createNestedObject("metadata");
-          meta["wasmachine_id"] = WASMACHINE_ID;
-          meta["sensor_id"] = WASMACHINE_ID;
-          meta["this_cycle_time"] = elapsed_sec;
-          meta["total_time_operated"] = TimeData.hoursOfOperation;
-          char JSONmessageBuffer[200];
-          serializeJson(JSONbuffer, JSONmessageBuffer);
           #ifdef TAGO
-          if (tago_client.publish(STATE_TOPIC, JSONmessageBuffer) == true)
+          if (publish_state(tago_client, tago_pending, JSONmessageBuffer) == true)
           {
             Serial.println("The cycle has ended");
             lcd.setCursor(0,1);
@@ -496,7 +617,7 @@ void loop()
           }
           #endif
           #ifdef LOCAL
-          if (local_client.publish(STATE_TOPIC, JSONmessageBuffer) == true)
+          if (publish_state(local_client, local_pending, JSONmessageBuffer) == true)
           {
             Serial.println("published to local client)");
             Serial.println("The cycle has ended");
@@ -504,31 +625,52 @@ void loop()
             lcd.print("cycle stopped");
           }
           #endif
-          Serial.println(millis() - EndOfCycle);
-          
-          
-          Serial.println("Statistics:");
-          Serial.println("total seconds on:");
-          Serial.println(TimeData.hoursOfOperation);
-          Serial.println("last cycle in seconds:");
-          Serial.println(TimeData.lastUpdate);
-        }     
+        }
+
+        Serial.println("Statistics:");
+        Serial.println("total ms on:");
+        Serial.println(TimeData.operatedMillis);
+        Serial.println("last cycle in ms:");
+        Serial.println(TimeData.lastCycleMillis);
       }
       state = 0;
     }
-    // If device is on, record the time that it was on.
-    if (device_state == 2 || device_state == 3)
-    {
-      // Calculate the elapsed time since the start time
-      elapsedTime = millis() - startTime;
-      TimeData.hoursOfOperation += ((elapsedTime/1000) - TimeData.lastUpdate);
-      elapsed_sec = (elapsedTime/1000);
-      TimeData.lastUpdate = (elapsedTime/1000);
-      writeTimeToFile(SPIFFS, counterfilename, TimeData);
-    }
   }
 }
 
+// metadata for the messages of the last RMS window
+MeterInfo meter_info()
+{
+  MeterInfo info = {};
+  info.wasmachine_id = WASMACHINE_ID;
+  info.sensor_id = SENSOR_ID;
+  info.session_id = session_id;
+  info.this_cycle_time = TimeData.lastCycleMillis / 1000;
+  info.total_time_operated = TimeData.operatedMillis / 1000;
+  info.timestamp = windowStart;
+  info.unix_ms = wallclock_ms(windowStart);
+  return info;
+}
+
+// wall clock time in ms (Unix) of an esp_timer_get_time() timestamp.
+// Returns 0 until SNTP has set the clock.
+uint64_t wallclock_ms(uint64_t timestamp)
+{
+#ifdef SNTP
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < 1700000000) // clock not set yet
+  {
+    return 0;
+  }
+  uint64_t now = esp_timer_get_time();
+  uint64_t wall = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  return (wall - (now - timestamp)) / 1000;
+#else
+  return 0;
+#endif
+}
+
 void connect_mqtt()
 {
   // connect to brokers with auth and set the LWT message
@@ -553,6 +695,343 @@ void connect_mqtt()
   #endif
 }
 
+#ifdef FAST_BOOT
+// start connecting to wifi without waiting for the result
+void start_wifi()
+{
+  Serial.print("Connecting to ");
+  Serial.println(ssid);
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+  WiFi.begin(ssid, password);
+#ifdef SNTP
+  // UTC. SNTP syncs in the background once WiFi is up.
+  configTime(0, 0, NTP_SERVER);
+#endif
+}
+
+// resolve the broker names. WiFi.hostByName() can block for seconds,
+// so this runs in its own task and network_task() polls dns_done.
+void dns_task(void *parameter)
+{
+  bool ok = true;
+  #ifdef TAGO
+  ok &= WiFi.hostByName(BROKER_URL, tago_ip) == 1;
+  #endif
+  #ifdef LOCAL
+  ok &= WiFi.hostByName(LOCAL_BROKER_URL, local_ip) == 1;
+  #endif
+  dns_ok = ok;
+  dns_done = true;
+  vTaskDelete(NULL);
+}
+
+// one connection attempt per broker. Like for dns_task(), network_task() polls mqtt_done.
+// loop() does not touch the clients until the task is done, see mqtt_ready().
+// The CONNACK wait of PubSubClient is a busy loop, meanwhile the sampling loop
+// gets less CPU time and the RMS window has fewer samples, but no gap.
+void mqtt_task(void *parameter)
+{
+  mqtt_ok = try_connect_mqtt();
+  mqtt_done = true;
+  vTaskDelete(NULL);
+}
+
+// one connection attempt per broker, returns true when all are connected
+bool try_connect_mqtt()
+{
+  bool connected = true;
+  #ifdef TAGO
+  if (!tago_client.connected())
+  {
+    Serial.println("connecting to tago...");
+    connected &= tago_client.connect("espcurrent", "Token", TAGO_TOKEN, "meter2/state", 1, 1, "[{\"variable\":\"state\",\"value\":\"offline\"}]");
+  }
+  #endif
+  #ifdef LOCAL
+  if (!local_client.connected())
+  {
+    Serial.println("connecting to local broker...");
+    connected &= local_client.connect("meter_2", MQTT_USER, MQTT_PASSWORD, STATE_TOPIC, 1, 1, "[{\"variable\":\"state\",\"value\":\"offline\"}]");
+  }
+  #endif
+  return connected;
+}
+
+bool mqtt_connected()
+{
+  bool connected = true;
+  #ifdef TAGO
+  connected &= tago_client.connected();
+  #endif
+  #ifdef LOCAL
+  connected &= local_client.connected();
+  #endif
+  return connected;
+}
+
+// network state machine. Every step returns immediately so sampling keeps running,
+// the blocking calls run in dns_task() and mqtt_task().
+void network_task()
+{
+  unsigned long now = millis();
+  switch (net_state)
+  {
+  case NET_WIFI:
+    if (!wifi_started)
+    {
+      // keep the radio off until the first window is measured
+      if (first_window_done)
+      {
+        Serial.printf("Starting WiFi after %lu ms\n", now);
+        start_wifi();
+        wifi_started = true;
+        lastNetAttempt = now;
+      }
+    }
+    else if (!WiFi.isConnected())
+    {
+      // setAutoReconnect() gives up on some disconnect reasons, e.g. when
+      // the access point is not found after a power cut. Keep trying.
+      if (now - lastNetAttempt >= NET_RETRY_PERIOD)
+      {
+        lastNetAttempt = now;
+        Serial.println("WiFi not connected, reconnecting...");
+        WiFi.reconnect();
+      }
+    }
+    else
+    {
+      if (wifiReadyMillis == 0)
+      {
+        wifiReadyMillis = now;
+      }
+      Serial.printf("WiFi ready after %lu ms, IP address: ", now);
+      Serial.println(WiFi.localIP());
+      lcd.setCursor(0, 1);
+      lcd.print(WiFi.localIP());
+      // mDNS and OTA only need to be started once. The broker names are
+      // resolved again after every reconnect, their address may have changed.
+      if (!ota_started)
+        net_state = NET_MDNS;
+      else
+        net_state = NET_DNS;
+      lastNetAttempt = now - NET_RETRY_PERIOD;
+    }
+    break;
+  case NET_MDNS:
+    if (now - lastNetAttempt >= 1000)
+    {
+      lastNetAttempt = now;
+      if (mdns_init() != ESP_OK)
+      {
+        Serial.println("Starting MDNS...");
+        break;
+      }
+      ArduinoOTA.begin();
+      ota_started = true;
+      otaReadyMillis = now;
+      Serial.printf("mDNS and OTA ready after %lu ms\n", now);
+      net_state = NET_DNS;
+      lastNetAttempt = now - NET_RETRY_PERIOD;
+    }
+    break;
+  case NET_DNS:
+    if (!dns_started)
+    {
+      if (!WiFi.isConnected())
+      {
+        net_state = NET_WIFI;
+        lastNetAttempt = now;
+      }
+      else if (now - lastNetAttempt >= NET_RETRY_PERIOD)
+      {
+        dns_started = true;
+        dns_done = false;
+        if (xTaskCreate(dns_task, "dns_task", 4096, NULL, 1, NULL) != pdPASS)
+        {
+          dns_started = false;
+          lastNetAttempt = now;
+        }
+      }
+      break;
+    }
+    if (!dns_done)
+    {
+      break;
+    }
+    dns_started = false;
+    lastNetAttempt = now;
+    if (!dns_ok)
+    {
+      Serial.println("Broker DNS lookup failed");
+      break;
+    }
+    // connect by address from now on, so PubSubClient does no DNS lookup
+    #ifdef TAGO
+    tago_client.setServer(tago_ip, 1883);
+    #endif
+    #ifdef LOCAL
+    local_client.setServer(local_ip, LOCAL_BROKER_PORT);
+    #endif
+    mqttFailures = 0;
+    Serial.printf("Broker DNS ready after %lu ms\n", now);
+    net_state = NET_MQTT;
+    lastNetAttempt = now - NET_RETRY_PERIOD;
+    break;
+  case NET_MQTT:
+    if (!mqtt_started)
+    {
+      if (!WiFi.isConnected())
+      {
+        net_state = NET_WIFI;
+        lastNetAttempt = now;
+      }
+      else if (now - lastNetAttempt >= NET_RETRY_PERIOD)
+      {
+        mqtt_started = true;
+        mqtt_done = false;
+        if (xTaskCreate(mqtt_task, "mqtt_task", 4096, NULL, 1, NULL) != pdPASS)
+        {
+          mqtt_started = false;
+          lastNetAttempt = now;
+        }
+      }
+      break;
+    }
+    if (!mqtt_done)
+    {
+      break;
+    }
+    mqtt_started = false;
+    lastNetAttempt = now;
+    if (mqtt_ok)
+    {
+      net_state = NET_READY;
+      mqttFailures = 0;
+      Serial.printf("MQTT ready after %lu ms\n", now);
+      if (mqttReadyMillis == 0)
+      {
+        mqttReadyMillis = now;
+        publish_health();
+      }
+    }
+    else if (++mqttFailures >= MQTT_FAILS_BEFORE_DNS)
+    {
+      // the broker may have moved to another address
+      Serial.println("MQTT connection failed, resolving the broker again");
+      net_state = NET_DNS;
+    }
+    break;
+  case NET_READY:
+    if (!WiFi.isConnected())
+    {
+      net_state = NET_WIFI;
+      lastNetAttempt = now;
+      break;
+    }
+    if (!mqtt_connected())
+    {
+      net_state = NET_MQTT;
+      lastNetAttempt = now - NET_RETRY_PERIOD;
+      break;
+    }
+    #ifdef TAGO
+    flush_states(tago_client, tago_pending);
+    tago_client.loop();
+    #endif
+    #ifdef LOCAL
+    flush_states(local_client, local_pending);
+    local_client.loop();
+    #endif
+    break;
+  }
+}
+
+// publish the boot timing once the broker is reachable.
+// all times are relative to the application start, bootloader time not included.
+void publish_health()
+{
+  StaticJsonDocument<256> JSONbuffer;
+  JsonArray array = JSONbuffer.to<JsonArray>();
+  JsonObject health = array.createNestedObject();
+  health["variable"] = "health";
+  health["unit"] = "us";
+  health["value"] = firstSampleMicros; // time to first sample
+  JsonObject meta = health.createNestedObject("metadata");
+  meta["wasmachine_id"] = WASMACHINE_ID;
+  meta["sensor_id"] = SENSOR_ID;
+  meta["since"] = "app_start"; // esp_timer, excludes the bootloader
+  meta["wifi_ready_ms"] = wifiReadyMillis;
+  meta["ota_ready_ms"] = otaReadyMillis;
+  meta["mqtt_ready_ms"] = mqttReadyMillis;
+  char JSONmessageBuffer[PAYLOAD_SIZE];
+  serializeJson(JSONbuffer, JSONmessageBuffer);
+  Serial.println(JSONmessageBuffer);
+  #ifdef TAGO
+  tago_client.publish(HEALTH_TOPIC, JSONmessageBuffer);
+  #endif
+  #ifdef LOCAL
+  if (local_client.publish(HEALTH_TOPIC, JSONmessageBuffer) == true)
+  {
+    Serial.println("published health to local client");
+  }
+  #endif
+}
+#endif
+
+// true when loop() may use the MQTT clients. In fast boot mode they belong
+// to mqtt_task() until network_task() reaches NET_READY.
+bool mqtt_ready()
+{
+#ifdef FAST_BOOT
+  return net_state == NET_READY;
+#else
+  return true;
+#endif
+}
+
+// publish a state message, or keep it for flush_states() when the broker is not
+// connected. Messages that are already waiting go first, so the order is kept.
+bool publish_state(PubSubClient &client, PendingStates &pending, const char *payload)
+{
+#ifndef FAST_BOOT
+  // connect_mqtt() blocks until connected, nothing to queue
+  return client.publish(STATE_TOPIC, payload);
+#else
+  if (pending.count == 0 && mqtt_ready() && client.publish(STATE_TOPIC, payload))
+  {
+    return true;
+  }
+  if (pending.count == PENDING_STATES)
+  {
+    // drop the oldest
+    pending.first = (pending.first + 1) % PENDING_STATES;
+    pending.count--;
+  }
+  int slot = (pending.first + pending.count) % PENDING_STATES;
+  strlcpy(pending.payload[slot], payload, PAYLOAD_SIZE);
+  pending.count++;
+  Serial.println("state message queued until the broker is connected");
+  return false;
+#endif
+}
+
+// send the queued state messages, oldest first
+void flush_states(PubSubClient &client, PendingStates &pending)
+{
+  while (pending.count > 0)
+  {
+    if (!client.publish(STATE_TOPIC, pending.payload[pending.first]))
+    {
+      return;
+    }
+    Serial.println("queued state message published");
+    pending.first = (pending.first + 1) % PENDING_STATES;
+    pending.count--;
+  }
+}
+
 void setup_wifi()
 {
   // connect to wifi with ssid and password
@@ -650,8 +1129,17 @@ HoursOfOperationData readTimeFromFile(fs::FS &fs, const char *counterfile)
     return {0, 0}; // Return default values
   }
   HoursOfOperationData data;
-  data.lastUpdate = doc["lastUpdate"] ;
-  data.hoursOfOperation  = doc["hoursOfOperation"] ;
+  if (doc.containsKey("operatedMillis"))
+  {
+    data.lastCycleMillis = doc["lastCycleMillis"].as<uint64_t>();
+    data.operatedMillis = doc["operatedMillis"].as<uint64_t>();
+  }
+  else
+  {
+    // older firmware stored whole seconds
+    data.lastCycleMillis = doc["lastUpdate"].as<uint64_t>() * 1000;
+    data.operatedMillis = doc["hoursOfOperation"].as<uint64_t>() * 1000;
+  }
   return data;
 }
 
@@ -664,8 +1152,8 @@ void writeTimeToFile(fs::FS &fs, const char *counterfile, const HoursOfOperation
     return;
   }
   StaticJsonDocument<256> doc;
-  doc["lastUpdate"] = data.lastUpdate;
-  doc["hoursOfOperation"] = data.hoursOfOperation ;
+  doc["lastCycleMillis"] = data.lastCycleMillis;
+  doc["operatedMillis"] = data.operatedMillis;
 
   if (serializeJson(doc, file) == 0)
   {
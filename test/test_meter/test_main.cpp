@@ -0,0 +1,215 @@
+// Host tests for lib/meter: cycle detection, operating time and payload builders.
+// run with: pio test -e native
+#include <string.h>
+#include <unity.h>
+#include <meter.h>
+
+#define WINDOW 1000000 // µs, one RMS window
+#define ON_AMPS 1.0
+#define OFF_AMPS 0.05
+
+// feed one window starting at t and move t to the next window
+static CycleEvent feed(CycleDetector &cycle, float amps, uint64_t &t)
+{
+  CycleEvent event = cycle.update(amps, t, t + WINDOW);
+  t += WINDOW;
+  return event;
+}
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_cycle_start(void)
+{
+  CycleDetector cycle;
+  uint64_t t = 5000000;
+  TEST_ASSERT_EQUAL(CYCLE_NONE, feed(cycle, OFF_AMPS, t));
+  TEST_ASSERT_EQUAL(DEVICE_OFF, cycle.state());
+  TEST_ASSERT_FALSE(cycle.running());
+
+  uint64_t start = t;
+  TEST_ASSERT_EQUAL(CYCLE_STARTED, feed(cycle, ON_AMPS, t));
+  TEST_ASSERT_EQUAL(DEVICE_ON, cycle.state());
+  TEST_ASSERT_TRUE(cycle.running());
+  TEST_ASSERT_EQUAL_UINT64(start, cycle.cycleStart());
+  TEST_ASSERT_EQUAL_UINT64(start + WINDOW, cycle.cycleEnd());
+
+  // staying on does not start a new cycle
+  TEST_ASSERT_EQUAL(CYCLE_NONE, feed(cycle, ON_AMPS, t));
+  TEST_ASSERT_EQUAL_UINT64(start, cycle.cycleStart());
+}
+
+void test_cycle_dip_recovers(void)
+{
+  CycleDetector cycle;
+  uint64_t t = 0;
+  uint64_t start = t;
+  feed(cycle, ON_AMPS, t);
+  feed(cycle, ON_AMPS, t);
+  uint64_t lastActive = t;
+
+  // a pause shorter than END_OF_CYCLE
+  for (int i = 0; i < 60; i++)
+  {
+    TEST_ASSERT_EQUAL(CYCLE_NONE, feed(cycle, OFF_AMPS, t));
+    TEST_ASSERT_EQUAL(DEVICE_ENDING, cycle.state());
+    TEST_ASSERT_TRUE(cycle.running());
+    TEST_ASSERT_EQUAL_UINT64(lastActive, cycle.cycleEnd());
+  }
+
+  TEST_ASSERT_EQUAL(CYCLE_NONE, feed(cycle, ON_AMPS, t));
+  TEST_ASSERT_EQUAL(DEVICE_ON, cycle.state());
+  TEST_ASSERT_EQUAL_UINT64(start, cycle.cycleStart());
+  TEST_ASSERT_EQUAL_UINT64(t, cycle.cycleEnd());
+}
+
+void test_cycle_end(void)
+{
+  CycleDetector cycle;
+  uint64_t t = 0;
+  feed(cycle, ON_AMPS, t);
+  feed(cycle, ON_AMPS, t);
+  uint64_t lastActive = t;
+
+  // the end is reported END_OF_CYCLE after the end of the last active window
+  while (t + WINDOW - lastActive < (uint64_t)END_OF_CYCLE * 1000)
+  {
+    TEST_ASSERT_EQUAL(CYCLE_NONE, feed(cycle, OFF_AMPS, t));
+  }
+  TEST_ASSERT_EQUAL(CYCLE_ENDED, feed(cycle, OFF_AMPS, t));
+  TEST_ASSERT_EQUAL_UINT64((uint64_t)END_OF_CYCLE * 1000, t - lastActive);
+  TEST_ASSERT_EQUAL(DEVICE_OFF, cycle.state());
+  TEST_ASSERT_FALSE(cycle.running());
+
+  // a new cycle can start after the end
+  TEST_ASSERT_EQUAL(CYCLE_STARTED, feed(cycle, ON_AMPS, t));
+}
+
+void test_cycle_time(void)
+{
+  CycleDetector cycle;
+  uint64_t t = 0;
+  for (int i = 0; i < 10; i++)
+  {
+    feed(cycle, ON_AMPS, t);
+    TEST_ASSERT_EQUAL_UINT64((uint64_t)(i + 1) * WINDOW, cycle.cycleTime());
+  }
+  // the END_OF_CYCLE wait does not count
+  while (feed(cycle, OFF_AMPS, t) != CYCLE_ENDED)
+    ;
+  TEST_ASSERT_EQUAL_UINT64(10ULL * WINDOW, cycle.cycleTime());
+}
+
+// feed one window to the detector and the operating time, like the firmware loop
+static bool feed(CycleDetector &cycle, OperatingTime &operating, float amps, uint64_t &t)
+{
+  return operating.update(cycle, feed(cycle, amps, t));
+}
+
+// run one cycle of the given number of windows until its end is reported
+static void run_cycle(CycleDetector &cycle, OperatingTime &operating, int windows, uint64_t &t)
+{
+  for (int i = 0; i < windows; i++)
+  {
+    TEST_ASSERT_TRUE(feed(cycle, operating, ON_AMPS, t));
+  }
+  while (cycle.running())
+  {
+    // nothing changes while waiting for the end
+    TEST_ASSERT_FALSE(feed(cycle, operating, OFF_AMPS, t));
+  }
+}
+
+void test_operating_time(void)
+{
+  CycleDetector cycle;
+  OperatingTime operating(5000, 700); // saved before
+  uint64_t t = 0;
+  TEST_ASSERT_FALSE(feed(cycle, operating, OFF_AMPS, t));
+  TEST_ASSERT_EQUAL_UINT64(5000, operating.operatedMillis());
+  TEST_ASSERT_EQUAL_UINT64(700, operating.lastCycleMillis());
+
+  run_cycle(cycle, operating, 3, t);
+  TEST_ASSERT_EQUAL_UINT64(3000, operating.lastCycleMillis());
+  TEST_ASSERT_EQUAL_UINT64(8000, operating.operatedMillis());
+}
+
+void test_operating_time_equal_cycles(void)
+{
+  // two one-window cycles of the same length must both be counted
+  CycleDetector cycle;
+  OperatingTime operating;
+  uint64_t t = 0;
+  run_cycle(cycle, operating, 1, t);
+  TEST_ASSERT_EQUAL_UINT64(1000, operating.operatedMillis());
+  run_cycle(cycle, operating, 1, t);
+  TEST_ASSERT_EQUAL_UINT64(1000, operating.lastCycleMillis());
+  TEST_ASSERT_EQUAL_UINT64(2000, operating.operatedMillis());
+}
+
+static MeterInfo test_info(void)
+{
+  MeterInfo info = {};
+  info.wasmachine_id = 2;
+  info.sensor_id = 2;
+  info.session_id = 2001;
+  info.this_cycle_time = 10;
+  info.total_time_operated = 1000;
+  info.timestamp = 123456789;
+  return info;
+}
+
+void test_payload_fits(void)
+{
+  MeterInfo info = test_info();
+  info.cycle_start = 1000000;
+  info.cycle_end = 3000000;
+  char buffer[400];
+  size_t length = build_state_payload(buffer, sizeof(buffer), "2", info);
+  TEST_ASSERT_TRUE(length > 0);
+  TEST_ASSERT_EQUAL(length, strlen(buffer));
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "\"group\":\"2001\""));
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "\"cycle_time_ms\":2000"));
+
+  // the terminating zero must fit too
+  TEST_ASSERT_EQUAL(0, build_state_payload(buffer, length, "2", info));
+  TEST_ASSERT_EQUAL(length, build_state_payload(buffer, length + 1, "2", info));
+
+  length = build_current_payload(buffer, sizeof(buffer), 1.5, info);
+  TEST_ASSERT_TRUE(length > 0);
+  TEST_ASSERT_EQUAL(length, strlen(buffer));
+  TEST_ASSERT_NOT_NULL(strstr(buffer, "\"value\":1500"));
+}
+
+void test_payload_overflow(void)
+{
+  MeterInfo info = test_info();
+  char buffer[64];
+  memset(buffer, 'x', sizeof(buffer));
+  TEST_ASSERT_EQUAL(0, build_state_payload(buffer, sizeof(buffer), "1", info));
+  TEST_ASSERT_EQUAL(0, build_current_payload(buffer, sizeof(buffer), 1.5, info));
+  // the buffer is left untouched
+  for (size_t i = 0; i < sizeof(buffer); i++)
+  {
+    TEST_ASSERT_EQUAL('x', buffer[i]);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_cycle_start);
+  RUN_TEST(test_cycle_dip_recovers);
+  RUN_TEST(test_cycle_end);
+  RUN_TEST(test_cycle_time);
+  RUN_TEST(test_operating_time);
+  RUN_TEST(test_operating_time_equal_cycles);
+  RUN_TEST(test_payload_fits);
+  RUN_TEST(test_payload_overflow);
+  return UNITY_END();
+}